@@ -9,12 +9,16 @@
 
 static const EVP_MD* evp_md = NULL;
 
+/* its loc conf starts with ngx_http_upstream_conf_t, see ngx_http_aws_auth_handler */
+extern ngx_module_t ngx_http_proxy_module;
+
 #define AWS_S3_VARIABLE "s3_auth_token"
 #define AWS_DATE_VARIABLE "aws_date"
 
 static void* ngx_http_aws_auth_create_loc_conf(ngx_conf_t *cf);
 static char* ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static ngx_int_t register_variable(ngx_conf_t *cf);
+static ngx_int_t ngx_http_aws_auth_handler(ngx_http_request_t *r);
 static char *
 ngx_http_aws_auth_set_s3_bucket(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *
@@ -30,10 +34,17 @@ typedef struct {
     ngx_str_t secret;
     ngx_str_t s3_bucket;
     ngx_str_t chop_prefix;
+    ngx_flag_t sign;
+    ngx_http_handler_pt handler;
     ngx_http_aws_auth_script_t *s3_bucket_script;
     ngx_http_aws_auth_script_t *chop_prefix_script;
 } ngx_http_aws_auth_conf_t;
 
+typedef struct {
+    ngx_str_t date;
+    ngx_str_t signature;
+} ngx_http_aws_auth_ctx_t;
+
 static const char *signed_subresources[] = {
   "acl",
   "cors",
@@ -90,6 +101,13 @@ static ngx_command_t  ngx_http_aws_auth_commands[] = {
       offsetof(ngx_http_aws_auth_conf_t, chop_prefix),
       NULL },
 
+    { ngx_string("aws_sign"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_aws_auth_conf_t, sign),
+      NULL },
+
       ngx_null_command
 };
 
@@ -210,6 +228,8 @@ ngx_http_aws_auth_create_loc_conf(ngx_conf_t *cf)
         return NGX_CONF_ERROR;
     }
 
+    conf->sign = NGX_CONF_UNSET;
+
     return conf;    
 }
 
@@ -224,6 +244,27 @@ ngx_http_aws_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->access_key, prev->access_key, "");
     ngx_conf_merge_str_value(conf->secret, prev->secret, "");
     ngx_conf_merge_str_value(conf->chop_prefix, prev->chop_prefix, "");
+    ngx_conf_merge_value(conf->sign, prev->sign, 0);
+
+    if (conf->sign) {
+        /*
+         * Wrap the content handler so signing happens right before the proxy
+         * builds the upstream request. The proxy module is merged before this
+         * addon module (addons, static or dynamic, follow it in ngx_modules),
+         * so the handler its merge sets for limit_except is already in place.
+        */
+        ngx_http_core_loc_conf_t *clcf;
+        clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+        if (clcf->handler != NULL && clcf->handler != ngx_http_aws_auth_handler) {
+            conf->handler = clcf->handler;
+            clcf->handler = ngx_http_aws_auth_handler;
+        }
+    }
+
+    /* "if" blocks have no handler of their own and run the outer wrapper */
+    if (conf->handler == NULL) {
+        conf->handler = prev->handler;
+    }
 
     return NGX_CONF_OK;
 }
@@ -243,7 +284,7 @@ ngx_http_cmp_hnames(const void *one, const void *two) {
 }
 
 static ngx_int_t
-ngx_http_aws_auth_get_canon_headers(ngx_http_request_t *r, ngx_str_t *retstr) {
+ngx_http_aws_auth_get_canon_headers(ngx_http_request_t *r, ngx_str_t *date, ngx_str_t *retstr) {
     ngx_array_t       *v;
     ngx_list_part_t   *part;
     ngx_table_elt_t   *header, *el, *h;
@@ -298,12 +339,10 @@ ngx_http_aws_auth_get_canon_headers(ngx_http_request_t *r, ngx_str_t *retstr) {
     }
 
     ngx_str_t amz_date = ngx_string("x-amz-date");
-    u_char * val  = ngx_palloc(r->pool, ngx_cached_http_time.len + 1);
-    ngx_memcpy(val, ngx_cached_http_time.data, ngx_cached_http_time.len);
     h->key.data = amz_date.data;
     h->key.len  = amz_date.len;
-    h->value.data  = val;
-    h->value.len  = ngx_cached_http_time.len;
+    h->value.data  = date->data;
+    h->value.len  = date->len;
     lenall += h->key.len + h->value.len + 2;
 
     ngx_qsort(v->elts, (size_t) v->nelts, sizeof(ngx_table_elt_t), ngx_http_cmp_hnames);
@@ -468,8 +507,7 @@ ngx_http_aws_auth_sgn_newline(ngx_array_t* to_sign){
 }
 
 static ngx_int_t
-ngx_http_aws_auth_variable_s3(ngx_http_request_t *r, ngx_http_variable_value_t *v,
-    uintptr_t data)
+ngx_http_aws_auth_sign(ngx_http_request_t *r, ngx_str_t *date, ngx_str_t *retstr)
 {
     ngx_http_aws_auth_conf_t *aws_conf;
     ngx_array_t       *to_sign;
@@ -558,7 +596,7 @@ ngx_http_aws_auth_variable_s3(ngx_http_request_t *r, ngx_http_variable_value_t *
     if (el_sign == NULL) {
         return NGX_ERROR;
     }
-    ngx_http_aws_auth_get_canon_headers(r, el_sign);
+    ngx_http_aws_auth_get_canon_headers(r, date, el_sign);
     lenall += el_sign->len;
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, "normalized: %V", el_sign);
 
@@ -609,8 +647,42 @@ ngx_http_aws_auth_variable_s3(ngx_http_request_t *r, ngx_http_variable_value_t *
     ngx_sprintf(signature, "AWS %V:%s%Z", &aws_conf->access_key, str_to_sign);
     ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,"Signature: %s",signature);
 
-    v->len = ngx_strlen(signature);
-    v->data = signature;
+    retstr->len = ngx_strlen(signature);
+    retstr->data = signature;
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_variable_s3(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data)
+{
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_str_t         date, signature;
+
+    /* with aws_sign on, reuse its signature; signing again would see x-amz-date twice */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    if (ctx != NULL) {
+        v->len = ctx->signature.len;
+        v->data = ctx->signature.data;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
+        return NGX_OK;
+    }
+
+    date.data = ngx_pnalloc(r->pool, ngx_cached_http_time.len);
+    if (date.data == NULL) {
+        return NGX_ERROR;
+    }
+    date.len = ngx_cached_http_time.len;
+    ngx_memcpy(date.data, ngx_cached_http_time.data, date.len);
+
+    if (ngx_http_aws_auth_sign(r, &date, &signature) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    v->len = signature.len;
+    v->data = signature.data;
     v->valid = 1;
     v->no_cacheable = 0;
     v->not_found = 0;
@@ -621,8 +693,16 @@ static ngx_int_t
 ngx_http_aws_auth_variable_date(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     uintptr_t data)
 {   
-    v->len = ngx_cached_http_time.len;
-    v->data = ngx_cached_http_time.data;
+    ngx_http_aws_auth_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_aws_auth_module);
+    if (ctx != NULL) {
+        v->len = ctx->date.len;
+        v->data = ctx->date.data;
+    } else {
+        v->len = ngx_cached_http_time.len;
+        v->data = ngx_cached_http_time.data;
+    }
     v->valid = 1;
     v->no_cacheable = 0;
     v->not_found = 0;
@@ -657,6 +737,190 @@ register_variable(ngx_conf_t *cf)
     return NGX_OK;    
 }
 
+static ngx_int_t
+ngx_http_aws_auth_find_date_header(ngx_http_request_t *r, ngx_table_elt_t **retel)
+{
+    /*
+     * The proxy forwards every incoming header, so a second x-amz-date
+     * could not be kept from reaching S3 next to the signed one.
+    */
+    ngx_list_part_t   *part;
+    ngx_table_elt_t   *header;
+    ngx_uint_t        i;
+
+    *retel = NULL;
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].key.len == sizeof("x-amz-date") - 1
+            && ngx_strncasecmp(header[i].key.data, (u_char *) "x-amz-date",
+                               sizeof("x-amz-date") - 1) == 0)
+        {
+            if (*retel != NULL) {
+                ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "client sent duplicate x-amz-date header");
+                return NGX_HTTP_BAD_REQUEST;
+            }
+            *retel = &header[i];
+        }
+    }
+    return NGX_OK;
+}
+
+static ngx_table_elt_t *
+ngx_http_aws_auth_push_header(ngx_http_request_t *r, ngx_str_t *key, ngx_str_t *lowcase_key)
+{
+    ngx_table_elt_t   *h;
+
+    h = ngx_list_push(&r->headers_in.headers);
+    if (h == NULL) {
+        return NULL;
+    }
+    h->key.data = key->data;
+    h->key.len = key->len;
+    h->lowcase_key = lowcase_key->data;
+#if (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    return h;
+}
+
+static ngx_int_t
+ngx_http_aws_auth_sign_headers(ngx_http_request_t *r)
+{
+    ngx_http_aws_auth_ctx_t *ctx;
+    ngx_table_elt_t   *date_h, *auth_h;
+    ngx_str_t         date, signature;
+    ngx_str_t         amz_date = ngx_string("x-amz-date");
+    ngx_str_t         auth = ngx_string("Authorization");
+    ngx_str_t         auth_lc = ngx_string("authorization");
+    ngx_int_t         rc;
+
+    rc = ngx_http_aws_auth_find_date_header(r, &date_h);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    date.data = ngx_pnalloc(r->pool, ngx_cached_http_time.len);
+    if (date.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    date.len = ngx_cached_http_time.len;
+    ngx_memcpy(date.data, ngx_cached_http_time.data, date.len);
+
+    /* the canonical headers add their own x-amz-date line */
+    if (date_h != NULL) {
+        date_h->hash = 0;
+    }
+
+    if (ngx_http_aws_auth_sign(r, &date, &signature) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (date_h == NULL) {
+        date_h = ngx_http_aws_auth_push_header(r, &amz_date, &amz_date);
+        if (date_h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    date_h->hash = ngx_hash_key(amz_date.data, amz_date.len);
+    date_h->lowcase_key = amz_date.data;
+    date_h->value = date;
+
+    /* duplicate Authorization headers are already rejected by the core */
+    auth_h = r->headers_in.authorization;
+    if (auth_h == NULL) {
+        auth_h = ngx_http_aws_auth_push_header(r, &auth, &auth_lc);
+        if (auth_h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        r->headers_in.authorization = auth_h;
+    }
+    auth_h->hash = ngx_hash_key(auth_lc.data, auth_lc.len);
+    auth_h->lowcase_key = auth_lc.data;
+    auth_h->value = signature;
+
+    ctx = ngx_palloc(r->pool, sizeof(ngx_http_aws_auth_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->date = date;
+    ctx->signature = signature;
+    ngx_http_set_ctx(r, ctx, ngx_http_aws_auth_module);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_aws_auth_body_handler(ngx_http_request_t *r)
+{
+    ngx_http_aws_auth_conf_t *aws_conf;
+    ngx_int_t         rc;
+
+    aws_conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+
+    rc = ngx_http_aws_auth_sign_headers(r);
+    if (rc == NGX_OK) {
+        /* the body is already read, so this builds the upstream request now */
+        rc = aws_conf->handler(r);
+    }
+
+    ngx_http_finalize_request(r, rc);
+}
+
+static ngx_int_t
+ngx_http_aws_auth_handler(ngx_http_request_t *r)
+{
+    /*
+     * aws_sign on: sign once and hand Authorization and x-amz-date to the
+     * wrapped (proxy) content handler as request headers, so no
+     * proxy_set_header scripts run for them. With proxy_request_buffering on
+     * the body is read first, so the date is as fresh as the variables' one;
+     * otherwise signing happens before the body streams, as the variables do.
+     * Subrequests share the parent's header list and are not signed.
+    */
+    ngx_http_aws_auth_conf_t *aws_conf;
+    ngx_http_upstream_conf_t *ucf;
+    ngx_int_t         rc;
+
+    aws_conf = ngx_http_get_module_loc_conf(r, ngx_http_aws_auth_module);
+    if (aws_conf->handler == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "aws_sign: no content handler to wrap");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!aws_conf->sign || r != r->main) {
+        return aws_conf->handler(r);
+    }
+
+    ucf = ngx_http_get_module_loc_conf(r, ngx_http_proxy_module);
+    if (!ucf->request_buffering) {
+        rc = ngx_http_aws_auth_sign_headers(r);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+        return aws_conf->handler(r);
+    }
+
+    rc = ngx_http_read_client_request_body(r, ngx_http_aws_auth_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
 /* 
  * vim: ts=4 sw=4 et
  */
@@ -54,6 +54,14 @@ class Tester():
         headers = {'Content-Type': str(self.content_type),
                    'x-amz-meta-origin-a': 'valtest-a'}
         k.set_contents_from_string(self.content, headers=headers )        
+
+    def upload_with_stale_date(self):
+        bucket = self.conn.get_bucket(self.bucket)
+        k = Key(bucket)
+        k.key = self.fkey
+        headers = {'Content-Type': str(self.content_type),
+                   'x-amz-date': 'Thu, 01 Jan 2009 00:00:00 GMT'}
+        k.set_contents_from_string(self.content, headers=headers )
    
     def set_acl(self, policy):
         bucket = self.conn.get_bucket(self.bucket)
@@ -85,6 +93,18 @@ class Tester():
             return False
         return True
 
+    def test_upload_with_stale_date(self):
+        self.delete()
+        self.upload_with_stale_date()
+        self.set_acl('public-read')
+ 
+        bucket = self.conn.get_bucket(self.bucket)
+        k2 = Key(bucket)
+        k2.key = self.fkey
+        if k2.get_contents_as_string()!=self.content:
+            return False
+        return True
+
     def test_upload_private_acl(self):
         self.delete()
         self.upload()
@@ -179,6 +199,32 @@ class BotoTest(TestCase):
 
     def test_upload_multipart(self):
         self.assertEquals(self.boto_tester.test_multipart_upload(), True)
+
+
+class AwsSignTest(TestCase):
+    # bucket name is the location prefix, see /test2/ in nginx_sampleconf
+    bucket = 'test2'
+
+    def setUp(self):
+        self.boto_tester = Tester(s3_cred['host'], s3_cred['port'], s3_cred['access_key'],
+            s3_cred['secret_key'], self.bucket, 'filename.txt', 'filecontentttttt', 'text/html', U_M_LIMIT + 100)
+
+    def test_upload(self):
+        self.assertEquals(self.boto_tester.test_upload(), True)
+
+    def test_upload_with_headers(self):
+        self.assertEquals(self.boto_tester.test_upload_with_headers(), True)
+
+    def test_upload_with_stale_date(self):
+        self.assertEquals(self.boto_tester.test_upload_with_stale_date(), True)
+
+    def test_delete(self):
+        self.assertEquals(self.boto_tester.test_delete(), True)
+
+
+class AwsSignIfTest(AwsSignTest):
+    # /test3/ signs from inside an "if" block
+    bucket = 'test3'
         
 #---------------------------------------
 